@@ -1,10 +1,15 @@
+import math
+
 import esphome.codegen as cg
 import esphome.config_validation as cv
+import esphome.final_validate as fv
 from esphome import automation
-from esphome.components import select, switch, text, time
+from esphome.components import number, select, switch, text, text_sensor, time
+from esphome.core import CORE, ID
 from esphome.const import (
     CONF_ID,
     CONF_MODE,
+    CONF_OUTPUT,
     CONF_OUTPUTS,
     CONF_THEN,
     CONF_TIME_ID,
@@ -12,15 +17,23 @@ from esphome.const import (
     CONF_TYPE,
 )
 
-AUTO_LOAD = [ "select", "switch", "text" ]
+AUTO_LOAD = [ "number", "select", "switch", "text", "text_sensor" ]
+MULTI_CONF = True
 
 """
 timer:
   quantity: 3
+  #optional, RAM only timers for add_ephemeral_timer()
+  ephemeral_quantity: 8
+  #optional, slots for start_countdown()
+  countdowns: 4
   text_input:
     name: "Timer Configuration"
   timer_select:
     name: "Select Timer"
+  #or, for large quantities, pick the timer by number instead of one option per timer
+  timer_number:
+    name: "Timer Number"
   disable_switch:
     name: Disable Timers
   outputs:
@@ -33,12 +46,36 @@ timer:
   names:
     - "Timer 1"
     - "Lamp"
+  #optional, shared by every timer block so must be the same in each
+  restore_time_estimate: true
+  time_estimate_max_age: 1h
+  #optional, missed firings older than this are skipped when time arrives
+  max_catch_up: 10min
+  #optional, used for slots with nothing valid saved
+  defaults:
+    - "Live;1,Mode;0,Time;7:00,Repeat;1,Days;-MTWTF-,Output;0,Action;1"
+  #optional, referenced from the settings string with If;<index>
+  conditions:
+    - sun.is_below_horizon:
+  #optional, lists the next firings of this block
+  next_events:
+    - name: "Next Timers"
+      count: 3
+      output: 0
+    #set all_blocks to list the next firings of every timer block on the node instead
+    - name: "Next Timers Anywhere"
+      all_blocks: true
+  max_ramps: 4
+  ramp_interval: 1s
 """
 
 timer_ns = cg.esphome_ns.namespace("timer")
 Timer = timer_ns.class_("Timer", cg.Component)
+TimerScheduler = timer_ns.class_("TimerScheduler", cg.Component)
+TimerDefault = timer_ns.struct("TimerDefault")
 TimerText = timer_ns.class_("TimerText", text.Text, cg.Component)
 TimerSelect = timer_ns.class_("TimerSelect", select.Select, cg.Component)
+TimerNumber = timer_ns.class_("TimerNumber", number.Number, cg.Component)
 TimerDisableSwitch = timer_ns.class_("TimerDisableSwitch", switch.Switch, cg.Component)
 OutputTrigger = timer_ns.class_(
     "OutputTrigger", automation.Trigger.template(cg.float_)
@@ -46,12 +83,37 @@ OutputTrigger = timer_ns.class_(
 
 
 CONF_QUANTITY = "quantity"
+CONF_EPHEMERAL_QUANTITY = "ephemeral_quantity"
+CONF_COUNTDOWNS = "countdowns"
 CONF_TEXT_INPUT = "text_input"
 CONF_TIMER_SELECT = "timer_select"
+CONF_TIMER_NUMBER = "timer_number"
 CONF_DISABLE_SWITCH = "disable_switch"
 CONF_NAMES = "names"
 CONF_SWITCH = "switch"
 CONF_AUTOMATION = "automation"
+CONF_RESTORE_TIME_ESTIMATE = "restore_time_estimate"
+CONF_TIME_ESTIMATE_MAX_AGE = "time_estimate_max_age"
+CONF_MAX_CATCH_UP = "max_catch_up"
+CONF_MAX_RAMPS = "max_ramps"
+CONF_RAMP_INTERVAL = "ramp_interval"
+CONF_CONDITIONS = "conditions"
+CONF_NEXT_EVENTS = "next_events"
+CONF_EVENT_COUNT = "count"
+CONF_ALL_BLOCKS = "all_blocks"
+CONF_DEFAULTS = "defaults"
+CONF_DEFAULTS_ID = "defaults_id"
+
+KEY_SCHEDULER = "timer_scheduler"
+KEY_BLOCK_COUNT = "timer_block_count"
+PREFERENCE_BASE = 12345678
+
+# options of the shared scheduler, every block has to agree on them
+SCHEDULER_OPTIONS = [
+    CONF_TIME_ID,
+    CONF_RESTORE_TIME_ESTIMATE,
+    CONF_TIME_ESTIMATE_MAX_AGE,
+]
 
 def validate_names(config):
     if CONF_NAMES not in config:
@@ -60,6 +122,94 @@ def validate_names(config):
         raise cv.Invalid("number of names must be the same as the timer quantity")
     return config
 
+def parse_hour_minute(value):
+    hour, sep, minute = value.partition(":")
+    if not sep:
+        raise cv.Invalid(f"expected H:MM, got '{value}'")
+    hour, minute = int(hour), int(minute)
+    if not (0 <= hour <= 23 and 0 <= minute <= 59):
+        raise cv.Invalid(f"'{value}' is not a valid time")
+    return hour, minute
+
+def finite_float(value):
+    value = float(value)
+    if not math.isfinite(value):
+        raise cv.Invalid(f"{value} is not a finite number")
+    return value
+
+def timer_settings(value):
+    """Build time version of TimerData::from_string()."""
+    value = cv.string(value)
+    timer = {
+        "live": False,
+        "repeat": False,
+        "use_negative_offset": False,
+        "days": 0,
+        "mode": 0,
+        "output": 0,
+        "action": 0.0,
+        "ramp_from": 0.0,
+        "ramp_duration": 0,
+        "condition": -1,
+        "hour": 0,
+        "minute": 0,
+    }
+    for pair in value.split(","):
+        if not pair:
+            continue
+        key, sep, val = pair.partition(";")
+        if not sep:
+            raise cv.Invalid(f"expected Key;Value, got '{pair}'")
+        try:
+            if key == "Live":
+                timer["live"] = bool(int(val))
+            elif key == "Mode":
+                timer["mode"] = int(val)
+                if not 0 <= timer["mode"] <= 2:
+                    raise cv.Invalid("Mode must be 0, 1 or 2")
+            elif key == "Time":
+                timer["hour"], timer["minute"] = parse_hour_minute(val)
+            elif key == "Repeat":
+                timer["repeat"] = bool(int(val))
+            elif key == "Days":
+                if len(val) > 7:
+                    raise cv.Invalid("Days has at most 7 positions")
+                for i, day in enumerate(val):
+                    if day not in "-0":
+                        timer["days"] |= 1 << i
+            elif key == "Output":
+                timer["output"] = cv.int_range(min=0, max=255)(int(val))
+            elif key == "Action":
+                timer["action"] = finite_float(val)
+            elif key == "From":
+                timer["ramp_from"] = finite_float(val)
+            elif key == "Ramp":
+                timer["ramp_duration"] = cv.int_range(min=0, max=65535)(int(val))
+            elif key == "If":
+                timer["condition"] = cv.int_range(min=0, max=127)(int(val))
+            elif key == "Offset":
+                timer["use_negative_offset"] = val.startswith("-")
+                timer["hour"], timer["minute"] = parse_hour_minute(val.lstrip("+-"))
+            else:
+                raise cv.Invalid(f"unknown timer setting '{key}'")
+        except ValueError as err:
+            raise cv.Invalid(f"invalid value '{val}' for {key}") from err
+    return timer
+
+def validate_defaults(config):
+    if CONF_DEFAULTS not in config:
+        return config
+    if len(config[CONF_DEFAULTS]) > config[CONF_QUANTITY]:
+        raise cv.Invalid("more defaults than the timer quantity")
+    for index, timer in enumerate(config[CONF_DEFAULTS]):
+        if timer["output"] >= len(config[CONF_OUTPUTS]):
+            raise cv.Invalid(f"default {index} uses output {timer['output']} which does not exist")
+        if timer["ramp_duration"] and config[CONF_OUTPUTS][timer["output"]][CONF_TYPE] == CONF_SWITCH:
+            raise cv.Invalid(f"default {index} ramps output {timer['output']}, which is a switch and cannot ramp")
+        if timer["condition"] >= len(config.get(CONF_CONDITIONS, [])):
+            raise cv.Invalid(f"default {index} uses condition {timer['condition']} which does not exist")
+    return config
+
 OUTPUT_SCHEMA = cv.typed_schema(
     {
         CONF_SWITCH: {
@@ -80,42 +230,137 @@ CONFIG_SCHEMA = cv.All(
             cv.GenerateID(): cv.declare_id(Timer),
             cv.GenerateID(CONF_TIME_ID): cv.use_id(time.RealTimeClock),
             cv.Required(CONF_QUANTITY): cv.positive_int,
+            cv.Optional(CONF_EPHEMERAL_QUANTITY, default=0): cv.int_range(min=0, max=255),
+            cv.Optional(CONF_COUNTDOWNS, default=4): cv.int_range(min=0, max=255),
             cv.Required(CONF_TEXT_INPUT): text.TEXT_SCHEMA.extend(
                 {
                     cv.GenerateID(): cv.declare_id(TimerText),
                     cv.Optional(CONF_MODE, default="TEXT"): cv.enum(text.TEXT_MODES, upper=True),
                 }
             ),
-            cv.Required(CONF_TIMER_SELECT): select.select_schema(TimerSelect),
+            cv.Optional(CONF_TIMER_SELECT): select.select_schema(TimerSelect),
+            cv.Optional(CONF_TIMER_NUMBER): number.number_schema(TimerNumber),
             cv.Required(CONF_DISABLE_SWITCH): switch.switch_schema(TimerDisableSwitch),
             cv.Required(CONF_OUTPUTS): cv.ensure_list(OUTPUT_SCHEMA),
             cv.Optional(CONF_NAMES): cv.ensure_list(cv.string),
+            cv.Optional(CONF_CONDITIONS): cv.ensure_list(automation.validate_potentially_and_condition),
+            cv.GenerateID(CONF_DEFAULTS_ID): cv.declare_id(TimerDefault),
+            cv.Optional(CONF_DEFAULTS): cv.ensure_list(timer_settings),
+            cv.Optional(CONF_RESTORE_TIME_ESTIMATE, default=False): cv.boolean,
+            cv.Optional(CONF_TIME_ESTIMATE_MAX_AGE, default="1h"): cv.positive_time_period_seconds,
+            cv.Optional(CONF_MAX_CATCH_UP, default="10min"): cv.positive_time_period_seconds,
+            cv.Optional(CONF_NEXT_EVENTS): cv.ensure_list(
+                cv.All(
+                    text_sensor.text_sensor_schema().extend(
+                        {
+                            cv.Optional(CONF_EVENT_COUNT, default=3): cv.int_range(min=1, max=20),
+                            cv.Optional(CONF_OUTPUT): cv.uint8_t,
+                            cv.Optional(CONF_ALL_BLOCKS): cv.boolean,
+                        }
+                    ),
+                    # output indexes are per block, so they mean nothing across blocks
+                    cv.has_at_most_one_key(CONF_OUTPUT, CONF_ALL_BLOCKS),
+                )
+            ),
+            cv.Optional(CONF_MAX_RAMPS, default=4): cv.int_range(min=0, max=255),
+            cv.Optional(CONF_RAMP_INTERVAL, default="1s"): cv.All(
+                cv.positive_time_period_seconds, cv.Range(min=cv.TimePeriod(seconds=1))
+            ),
         }
     ),
+    cv.has_at_least_one_key(CONF_TIMER_SELECT, CONF_TIMER_NUMBER),
     validate_names,
+    validate_defaults,
 )
 
+def final_validate(config):
+    blocks = fv.full_config.get()["timer"]
+    for key in SCHEDULER_OPTIONS:
+        if str(config.get(key)) != str(blocks[0].get(key)):
+            raise cv.Invalid(f"{key} is shared by all timer blocks and must be the same in each")
+    if sum(not block[CONF_ID].is_manual for block in blocks) > 1:
+        raise cv.Invalid("with several timer blocks, give every block but one an id so its saved timers stay with it")
+    CORE.data[KEY_BLOCK_COUNT] = len(blocks)
+    return config
+
+def preference_base(config):
+    # a single block, or the one block without an id, keeps the original keys so existing
+    # saved timers still load, the others are keyed on their id so reordering the YAML
+    # does not swap their timers
+    if CORE.data.get(KEY_BLOCK_COUNT, 1) == 1 or not config[CONF_ID].is_manual:
+        return PREFERENCE_BASE
+    key = 2166136261
+    for char in config[CONF_ID].id.encode():
+        key = ((key ^ char) * 16777619) & 0xFFFFFFFF
+    return key
+
+FINAL_VALIDATE_SCHEMA = final_validate
+
+async def get_scheduler():
+    # all timer blocks share a single scheduler
+    if KEY_SCHEDULER not in CORE.data:
+        scheduler = cg.new_Pvariable(ID(KEY_SCHEDULER, is_declaration=True, type=TimerScheduler))
+        await cg.register_component(scheduler, {})
+        CORE.data[KEY_SCHEDULER] = scheduler
+    return CORE.data[KEY_SCHEDULER]
+
 async def to_code(config):
     var = cg.new_Pvariable(config[CONF_ID])
     await cg.register_component(var, config)
+    scheduler = await get_scheduler()
+    cg.add(var.set_scheduler(scheduler))
     time_ = await cg.get_variable(config[CONF_TIME_ID])
-    cg.add(var.set_time(time_))
+    cg.add(scheduler.set_time(time_))
+    cg.add(scheduler.set_restore_time_estimate(config[CONF_RESTORE_TIME_ESTIMATE]))
+    cg.add(scheduler.set_time_estimate_max_age(config[CONF_TIME_ESTIMATE_MAX_AGE].total_seconds))
+    cg.add(var.set_max_catch_up(config[CONF_MAX_CATCH_UP].total_seconds))
+    cg.add(var.set_max_ramps(config[CONF_MAX_RAMPS]))
+    cg.add(var.set_ramp_interval(config[CONF_RAMP_INTERVAL].total_seconds))
     numTimers = config[CONF_QUANTITY]
-    cg.add(var.set_num_timers(numTimers));
+    cg.add(var.set_num_timers(numTimers, preference_base(config)));
+    cg.add(var.set_num_ephemeral_timers(config[CONF_EPHEMERAL_QUANTITY]))
+    cg.add(var.set_num_countdowns(config[CONF_COUNTDOWNS]))
 
-    if CONF_NAMES in config:
-        names = config[CONF_NAMES]
-    else:
-        names = [f'Timer{n + 1}' for n in range(numTimers)]
+    if CONF_DEFAULTS in config:
+        # already parsed at validation, the device only copies these in
+        table = [
+            cg.StructInitializer(TimerDefault, *timer.items())
+            for timer in config[CONF_DEFAULTS]
+        ]
+        defaults = cg.progmem_array(config[CONF_DEFAULTS_ID], cg.ArrayInitializer(*table))
+        cg.add(var.set_defaults(defaults, len(table)))
 
     if CONF_TEXT_INPUT in config:
         txt = await text.new_text(config[CONF_TEXT_INPUT])
         cg.add(var.set_timer_text(txt))
 
     if CONF_TIMER_SELECT in config:
+        if CONF_NAMES in config:
+            names = config[CONF_NAMES]
+        else:
+            names = [f'Timer{n + 1}' for n in range(numTimers)]
         sel = await select.new_select(config[CONF_TIMER_SELECT], options=names)
         cg.add(var.set_timer_select(sel))
 
+    if CONF_TIMER_NUMBER in config:
+        # one entity whatever the quantity, the index is 1 based like the default names
+        num = await number.new_number(config[CONF_TIMER_NUMBER], min_value=1, max_value=numTimers, step=1)
+        cg.add(var.set_timer_number(num))
+
+    for conf in config.get(CONF_CONDITIONS, []):
+        cond = await automation.build_condition(conf, cg.TemplateArguments(), [])
+        cg.add(var.add_condition(cond))
+
+    if CONF_NAMES in config:
+        # next_events sensors label with these, an all_blocks one in another block included,
+        # without names they fall back to the same Timer<n> the select defaults to
+        cg.add(var.set_names(config[CONF_NAMES]))
+
+    for conf in config.get(CONF_NEXT_EVENTS, []):
+        sens = await text_sensor.new_text_sensor(conf)
+        cg.add(var.add_next_events_sensor(sens, conf[CONF_EVENT_COUNT], conf.get(CONF_OUTPUT, -1),
+                                          conf.get(CONF_ALL_BLOCKS, False)))
+
     for conf in config[CONF_OUTPUTS]:
         if conf[CONF_TYPE] == CONF_SWITCH:
             sw = await cg.get_variable(conf[CONF_ID])
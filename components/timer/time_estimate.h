@@ -0,0 +1,51 @@
+/****
+Copyright (c) 2024 RebbePod
+
+This library is free software; you can redistribute it and/or modify it 
+under the terms of the GNU Lesser GeneralPublic License as published by the Free Software Foundation; 
+either version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,but WITHOUT ANY WARRANTY; 
+without even the impliedwarranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. 
+See the GNU Lesser General Public License for more details. 
+You should have received a copy of the GNU Lesser General Public License along with this library; 
+if not, write tothe Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA, 
+or connect to: http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html
+****/
+
+// Time estimate helpers. Kept free of ESPHome includes so tests/ can build them on the host.
+
+#pragma once
+#include <cstdint>
+#include <ctime>
+
+namespace esphome {
+namespace timer {
+
+static const uint32_t TIME_ESTIMATE_MAGIC = 0x54494D45;
+
+// Last known epoch, kept in RTC memory so timers can run provisionally before time sync.
+// unsynced counts the seconds since real time was last seen, across warm resets.
+struct TimeEstimate {
+    uint32_t magic;
+    time_t epoch;
+    uint32_t unsynced;
+} __attribute__((packed));
+
+// Epoch estimated elapsed seconds after the estimate was restored,
+// or 0 when it is missing or has gone more than max_age seconds without real time.
+inline time_t estimate_epoch(const TimeEstimate &estimate, uint32_t elapsed, uint32_t max_age) {
+  if ((estimate.magic != TIME_ESTIMATE_MAGIC) || (estimate.epoch == 0))
+    return 0;
+  if ((estimate.unsynced > max_age) || (elapsed > max_age - estimate.unsynced))
+    return 0;
+  return estimate.epoch + elapsed;
+}
+
+// Whether a firing due at missed is still worth running when the scan happens at now.
+inline bool should_catch_up(time_t missed, time_t now, uint32_t max_catch_up) {
+  return missed && (missed < now) && (now - missed <= max_catch_up);
+}
+
+}  // namespace timer
+}  // namespace esphome
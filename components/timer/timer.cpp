@@ -27,23 +27,81 @@ or connect to: http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html
 * 12 = Output  {value '0' for the first position of switch in the 'relays' variable}
 * 13 = Action  {'0' turn off, '1' turn on, '2' toggle}
 * 14 = Mode    {'0' use time, '1' use sunrise, '2' use sunset} 
+* 15 = From    {value the output starts at when ramping towards Action}
+* 16 = Ramp    {seconds to ramp from From to Action, '0' jumps straight to Action}
+* 17 = If      {value '0' for the first entry of 'conditions', checked when the timer fires}
 * sample "Live;1,Mode;0,Time;2:36,Repeat;1,Days;SMTWTFS,Output;1,Action;2"
 ****************************************************/
 
 #include "timer.h"
+#include "esphome/core/hal.h"
 #include "esphome/core/helpers.h"
 #include "esphome/core/log.h"
 
+#include <cinttypes>
+
+#ifdef USE_ESP32
+#include <esp_attr.h>
+#include <esp_system.h>
+#endif
+#ifdef USE_ESP8266
+#include <Esp.h>
+#endif
+
 namespace esphome {
 namespace timer {
 
 static const char *const TAG = "timer";
+static const uint32_t TIME_ESTIMATE_SAVE_INTERVAL = 10;
+static const uint32_t EXTRAS_PREFERENCE_OFFSET = 0x10000;
+// check_countdowns_ compares against millis() as a signed difference, so about 24.8 days
+static const uint32_t MAX_COUNTDOWN_MS = INT32_MAX;
+
+#ifdef USE_ESP32
+// survives software, watchdog and brownout resets, a power loss clears it
+static RTC_NOINIT_ATTR TimeEstimate rtc_estimate;
+#endif
+
+// Only resets that restart the chip right away keep the estimate close to real time.
+// A deep-sleep wake, a reset pin held low or a power-on can hide any amount of time.
+static bool short_reset() {
+#if defined(USE_ESP32)
+  switch (esp_reset_reason()) {
+    case ESP_RST_SW:
+    case ESP_RST_PANIC:
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT:
+    case ESP_RST_BROWNOUT:
+      return true;
+    default:
+      return false;
+  }
+#elif defined(USE_ESP8266)
+  switch (ESP.getResetInfoPtr()->reason) {
+    case REASON_WDT_RST:
+    case REASON_EXCEPTION_RST:
+    case REASON_SOFT_WDT_RST:
+    case REASON_SOFT_RESTART:
+      return true;
+    default:
+      return false;
+  }
+#else
+  return false;
+#endif
+}
 
 TimerData::TimerData() {
   this->reset();
 }
 
-std::string TimerData::to_string() const {
+void TimerExtras::reset() {
+    this->ramp = TimerRamp{0, 0};
+    this->condition = -1;
+}
+
+std::string TimerData::to_string(const TimerExtras &extras) const {
     std::string result = str_sprintf("Live;%d,Mode;%d", this->live, this->mode);
 
     // Include time only if mode is 0
@@ -67,6 +125,10 @@ std::string TimerData::to_string() const {
       result += str_sprintf(",Action;%d", int(this->action));
     else
       result += str_sprintf(",Action;%f", this->action);
+    if (extras.ramp.duration)
+      result += str_sprintf(",From;%g,Ramp;%d", extras.ramp.from, extras.ramp.duration);
+    if (extras.condition >= 0)
+      result += str_sprintf(",If;%d", extras.condition);
 
     return result;
 }
@@ -85,8 +147,9 @@ void TimerData::reset() {
     this->last_ran_timestamp = 0;
 }
 
-void TimerData::from_string(const std::string& settings) {
+void TimerData::from_string(const std::string& settings, TimerExtras &extras) {
     this->reset(); // resets the timer
+    extras.reset();
     uint16_t index = 0;
     while (index < settings.size()) {
         // Find the next key-value pair
@@ -136,6 +199,12 @@ void TimerData::from_string(const std::string& settings) {
             this->output = std::stoi(value);
         } else if (key == "Action") {
             this->action = std::stof(value);
+        } else if (key == "From") {
+            extras.ramp.from = std::stof(value);
+        } else if (key == "Ramp") {
+            extras.ramp.duration = std::stoi(value);
+        } else if (key == "If") {
+            extras.condition = std::stoi(value);
         } else if (key == "Offset") {
             if (!value.empty()) {
                 size_t colonPos = value.find(':');
@@ -166,18 +235,35 @@ void TimerData::from_string(const std::string& settings) {
     this->valid = true;
 }
 
-time_t TimerData::calc_next(time::RealTimeClock *time, time_t last) {
+void TimerData::from_default(const TimerDefault &settings, TimerExtras &extras) {
+    this->reset();
+    extras.reset();
+    this->live = settings.live;
+    this->repeat = settings.repeat;
+    this->use_negative_offset = settings.use_negative_offset;
+    this->days.raw = settings.days;
+    this->mode = settings.mode;
+    this->output = settings.output;
+    this->action = settings.action;
+    extras.ramp.from = settings.ramp_from;
+    extras.ramp.duration = settings.ramp_duration;
+    extras.condition = settings.condition;
+    this->hour = settings.hour;
+    this->minute = settings.minute;
+    this->valid = true;
+}
+
+time_t TimerData::calc_next(time_t now, time_t last) {
   if ((this->days.raw == 0) || (!this->live))
     return 0;
-  ESPTime now = time->now();
-  if (!now.is_valid())
+  if (now == 0)
     return 0;
-  ESPTime next = last ? ESPTime::from_epoch_local(last) : now;
+  ESPTime next = ESPTime::from_epoch_local(last ? last : now);
   next.hour = this->hour;
   next.minute = this->minute;
   next.second = 0;
   next.recalc_timestamp_local();
-  if (next.timestamp <= now.timestamp)
+  if (next.timestamp <= now)
     next.increment_day();
   int offset = this->hour * 3600 + this->minute * 60;
   if (this->use_negative_offset)
@@ -188,64 +274,463 @@ time_t TimerData::calc_next(time::RealTimeClock *time, time_t last) {
   return next.timestamp;
 }
 
-void Timer::setup() {
-  for (auto &data : this->timers_) {
-    if (!std::get<2>(data).load(&std::get<0>(data)))
-      break;
+void TimerScheduler::setup() {
+  if (!this->restore_time_estimate_)
+    return;
+#ifdef USE_ESP8266
+  // in_flash=false is RTC user memory on the ESP8266
+  this->estimate_pref_ = global_preferences->make_preference<TimeEstimate>(12345677, false);
+#endif
+  TimeEstimate estimate;
+  if (!this->load_estimate_(&estimate) || !estimate_epoch(estimate, 0, this->time_estimate_max_age_))
+    return;
+  if (!short_reset()) {
+    ESP_LOGI(TAG, "reset may have taken any length of time, ignoring time estimate");
+    return;
   }
-  this->choose_(0, true);
+  this->restored_ = estimate;
+  this->estimate_millis_ = millis();
+  ESP_LOGI(TAG, "restored time estimate %ld, %" PRIu32 " seconds since last sync", (long) estimate.epoch, estimate.unsynced);
 }
 
-void Timer::loop() {
+bool TimerScheduler::load_estimate_(TimeEstimate *estimate) {
+#if defined(USE_ESP32)
+  *estimate = rtc_estimate;
+  return true;
+#elif defined(USE_ESP8266)
+  return this->estimate_pref_.load(estimate);
+#else
+  ESP_LOGW(TAG, "time estimate is not supported on this platform");
+  return false;
+#endif
+}
+
+void TimerScheduler::store_estimate_(const TimeEstimate &estimate) {
+#if defined(USE_ESP32)
+  rtc_estimate = estimate;
+#elif defined(USE_ESP8266)
+  if (!this->estimate_pref_.save(&estimate) && !this->estimate_save_failed_) {
+    ESP_LOGE(TAG, "could not save time estimate, RTC preference storage may be full");
+    this->estimate_save_failed_ = true;
+  }
+#endif
+}
+
+time_t TimerScheduler::now() {
   ESPTime now = this->time_->now();
-  if (!now.is_valid())
+  uint32_t elapsed = (millis() - this->estimate_millis_) / 1000;
+  if (now.is_valid()) {
+    if (this->provisional_) {
+      // real time arrived, drop the estimate and rescan against the real clock
+      ESP_LOGI(TAG, "time synced, estimate was %ld seconds behind",
+               (long) (now.timestamp - (this->restored_.epoch + elapsed)));
+      this->provisional_ = false;
+      this->init_done_ = false;
+    }
+    this->restored_.magic = 0;
+    return now.timestamp;
+  }
+  time_t estimate = estimate_epoch(this->restored_, elapsed, this->time_estimate_max_age_);
+  if (estimate == 0) {
+    if (this->restored_.magic == TIME_ESTIMATE_MAGIC) {
+      // past the error budget, stay idle until real time arrives
+      ESP_LOGW(TAG, "time estimate older than %" PRIu32 " seconds, dropping it", this->time_estimate_max_age_);
+      this->restored_.magic = 0;
+    }
+    return 0;
+  }
+  this->provisional_ = true;
+  return estimate;
+}
+
+void TimerScheduler::save_estimate_(time_t now) {
+  if (!this->restore_time_estimate_ || (now - this->last_estimate_save_ < TIME_ESTIMATE_SAVE_INTERVAL))
+    return;
+  this->last_estimate_save_ = now;
+  uint32_t unsynced = 0;
+  if (this->provisional_)
+    unsynced = this->restored_.unsynced + (now - this->restored_.epoch);
+  this->store_estimate_(TimeEstimate{TIME_ESTIMATE_MAGIC, now, unsynced});
+}
+
+void TimerScheduler::schedule(Timer *owner, uint16_t slot, time_t old_next, time_t next, DeadlineKind kind) {
+  if (old_next)
+    this->deadlines_.erase(Deadline{old_next, owner, slot, kind});
+  if (next)
+    this->deadlines_.insert(Deadline{next, owner, slot, kind});
+}
+
+std::vector<UpcomingEvent> TimerScheduler::next_events(size_t count, const Timer *owner, int output) const {
+  // the deadline set is already in firing order, so this is a walk from the front
+  std::vector<UpcomingEvent> events;
+  for (auto &deadline : this->deadlines_) {
+    if (events.size() >= count)
+      break;
+    if ((deadline.kind != DEADLINE_TIMER) || ((owner != nullptr) && (deadline.owner != owner)))
+      continue;
+    const TimerData &timer = std::get<0>(deadline.owner->timers_[deadline.slot]);
+    if ((output >= 0) && (timer.output != output))
+      continue;
+    events.push_back(UpcomingEvent{deadline.when, deadline.owner, deadline.slot, timer.output, timer.action});
+  }
+  return events;
+}
+
+void TimerScheduler::flush_() {
+  if (!this->dirty_)
+    return;
+  bool changed = false;
+  for (auto *timer : this->timers_)
+    changed |= timer->flush_();
+  // all_blocks next_events sensors follow every block, so any change refreshes all of them
+  if (changed) {
+    for (auto *timer : this->timers_)
+      timer->publish_next_events_();
+  }
+  this->dirty_ = false;
+}
+
+void TimerScheduler::loop() {
+  this->flush_();
+  // countdowns run on millis() and do not need the clock to be valid
+  uint32_t ms = millis();
+  for (auto *timer : this->timers_)
+    timer->check_countdowns_(ms);
+  time_t now = this->now();
+  if (now == 0)
     return;
   if (!this->init_done_) {
-    for (auto &data : this->timers_) {
-      time_t &next = std::get<1>(data);
-      if (next < now.timestamp) {
-        if (next)
-          this->trigger_timer_(data);
-        next = std::get<0>(data).calc_next(this->time_, 0);
-        std::get<2>(data).save(&std::get<0>(data));
-      }
-    }
+    for (auto *timer : this->timers_)
+      timer->start_(now);
     this->init_done_ = true;
+    this->flush_();
     return;
   }
-  if (this->last_check_ == now.timestamp)
+  if (this->last_check_ == now)
     return;
-  this->last_check_ = now.timestamp;
-  for (auto &data : this->timers_) {
-    time_t &next = std::get<1>(data);
-    if (next && (next <= now.timestamp)) {
-      this->trigger_timer_(data);
-      next = std::get<0>(data).calc_next(this->time_, 0);
-      std::get<2>(data).save(&std::get<0>(data));
+  this->last_check_ = now;
+  this->save_estimate_(now);
+  while (!this->deadlines_.empty() && (this->deadlines_.begin()->when <= now)) {
+    Deadline due = *this->deadlines_.begin();
+    this->deadlines_.erase(this->deadlines_.begin());
+    if (due.kind == DEADLINE_RAMP)
+      due.owner->step_ramp_(due.slot, now);
+    else
+      due.owner->fire_(due.slot, now);
+  }
+  this->flush_();
+}
+
+void Timer::setup() {
+  for (uint16_t slot = 0; slot < this->num_persistent_; slot++) {
+    TimerData &timer = std::get<0>(this->timers_[slot]);
+    TimerExtras &extras = std::get<3>(this->timers_[slot]);
+    // a saved timer wins, the build time default only fills slots with nothing valid saved
+    if (std::get<2>(this->timers_[slot]).load(&timer) && timer.valid) {
+      if (!std::get<4>(this->timers_[slot]).load(&extras))
+        extras.reset();
+      continue;
     }
+    timer.reset();
+    extras.reset();
+    if (slot >= this->num_defaults_)
+      continue;
+    TimerDefault settings;
+#ifdef USE_ESP8266
+    // the table is PROGMEM, which the ESP8266 can only read through memcpy_P
+    memcpy_P(&settings, &this->defaults_[slot], sizeof(settings));
+#else
+    settings = this->defaults_[slot];
+#endif
+    timer.from_default(settings, extras);
   }
+  this->choose_(0, nullptr);
 }
 
 void Timer::dump_config() {
 }
 
-void Timer::set_num_timers(int count) {
+void Timer::set_scheduler(TimerScheduler *scheduler) {
+  this->scheduler_ = scheduler;
+  scheduler->register_timer(this);
+}
+
+void Timer::set_num_timers(int count, uint32_t preference_base) {
   for (int i = 0; i < count; i++)
     this->timers_.emplace_back(std::make_tuple(TimerData(), 0,
-          global_preferences->make_preference<TimerData>(12345678 + i)));
+          global_preferences->make_preference<TimerData>(preference_base + i), TimerExtras(),
+          ESPPreferenceObject()));
+  // made after all the TimerData preferences so those keep their original order
+  for (int i = 0; i < count; i++)
+    std::get<4>(this->timers_[i]) =
+        global_preferences->make_preference<TimerExtras>(preference_base + EXTRAS_PREFERENCE_OFFSET + i);
+  this->num_persistent_ = count;
+  this->dirty_.resize(this->timers_.size(), false);
+}
+
+void Timer::set_num_ephemeral_timers(int count) {
+  // ephemeral slots sit after the persistent ones and have no preference behind them
+  for (int i = 0; i < count; i++)
+    this->timers_.emplace_back(std::make_tuple(TimerData(), 0, ESPPreferenceObject(), TimerExtras(),
+          ESPPreferenceObject()));
+  this->dirty_.resize(this->timers_.size(), false);
+}
+
+int Timer::add_ephemeral_timer(const std::string &settings) {
+  for (uint16_t slot = this->num_persistent_; slot < this->timers_.size(); slot++) {
+    TimerData &timer = std::get<0>(this->timers_[slot]);
+    if (timer.valid)
+      continue;
+    timer.from_string(settings, std::get<3>(this->timers_[slot]));
+    this->reschedule_(slot, timer.calc_next(this->scheduler_->now(), 0));
+    return slot;
+  }
+  ESP_LOGW(TAG, "no free ephemeral timer slot");
+  return -1;
+}
+
+bool Timer::remove_ephemeral_timer(int slot) {
+  if ((slot < this->num_persistent_) || (size_t(slot) >= this->timers_.size()))
+    return false;
+  // a slot that was never handed out, or already freed, is a stale id
+  if (!std::get<0>(this->timers_[slot]).valid)
+    return false;
+  std::get<0>(this->timers_[slot]).reset();
+  std::get<3>(this->timers_[slot]).reset();
+  this->reschedule_(slot, 0);
+  return true;
+}
+
+void Timer::start_(time_t now) {
+  // fire each recently missed timer at most once, then reschedule from now
+  for (uint16_t slot = 0; slot < this->timers_.size(); slot++) {
+    time_t next = std::get<1>(this->timers_[slot]);
+    if (next < now) {
+      if (should_catch_up(next, now, this->max_catch_up_))
+        this->fire_(slot, now);
+      else if (next)
+        ESP_LOGD(TAG, "skipping timer %d, missed by %ld seconds", slot + 1, (long) (now - next));
+      if (next && (slot >= this->num_persistent_) && !std::get<0>(this->timers_[slot]).repeat)
+        this->remove_ephemeral_timer(slot);
+      this->reschedule_(slot, std::get<0>(this->timers_[slot]).calc_next(now, 0));
+    }
+  }
 }
 
-void Timer::trigger_timer_(timer_tuple_t &data){
+void Timer::fire_(uint16_t slot, time_t now) {
+  auto &data = this->timers_[slot];
   TimerData &timer = std::get<0>(data);
-  int output = timer.output;
-  ESP_LOGD(TAG, "triggering output %d with action %f", output, timer.action);
+  const TimerRamp &ramp = std::get<3>(data).ramp;
+  int8_t condition = std::get<3>(data).condition;
+  if (this->check_condition_(condition)) {
+    ESP_LOGD(TAG, "triggering output %d with action %f", timer.output, timer.action);
+    if (ramp.duration && (timer.output < this->outputs_.size()) && this->rampable_[timer.output]) {
+      this->start_ramp_(timer.output, ramp.from, timer.action, ramp.duration, now);
+    } else {
+      if (ramp.duration)
+        ESP_LOGW(TAG, "output %d is a switch and cannot ramp, setting it to %f", timer.output, timer.action);
+      this->output_(timer.output, timer.action);
+    }
+  } else {
+    ESP_LOGD(TAG, "condition %d not met, skipping output %d", condition, timer.output);
+  }
+  if ((slot >= this->num_persistent_) && !timer.repeat) {
+    // one-shot ephemeral timers give their slot back as soon as they have run
+    this->remove_ephemeral_timer(slot);
+    return;
+  }
+  this->reschedule_(slot, timer.calc_next(now, std::get<1>(data)));
+}
+
+void Timer::set_num_countdowns(int count) {
+  this->countdowns_.resize(count);
+}
+
+int Timer::start_countdown(uint8_t output, float action, uint32_t duration_ms) {
+  if (duration_ms >= MAX_COUNTDOWN_MS) {
+    ESP_LOGW(TAG, "countdown of %" PRIu32 " ms is too long", duration_ms);
+    return -1;
+  }
+  for (size_t slot = 0; slot < this->countdowns_.size(); slot++) {
+    Countdown &countdown = this->countdowns_[slot];
+    if (countdown.active)
+      continue;
+    countdown.deadline = millis() + duration_ms;
+    countdown.output = output;
+    countdown.action = action;
+    countdown.active = true;
+    this->active_countdowns_++;
+    return slot;
+  }
+  ESP_LOGW(TAG, "no free countdown slot");
+  return -1;
+}
+
+bool Timer::cancel_countdown(int slot) {
+  if ((slot < 0) || (size_t(slot) >= this->countdowns_.size()) || !this->countdowns_[slot].active)
+    return false;
+  this->countdowns_[slot].active = false;
+  this->active_countdowns_--;
+  return true;
+}
+
+bool Timer::extend_countdown(int slot, uint32_t duration_ms) {
+  if ((slot < 0) || (size_t(slot) >= this->countdowns_.size()) || !this->countdowns_[slot].active)
+    return false;
+  Countdown &countdown = this->countdowns_[slot];
+  int32_t remaining = countdown.deadline - millis();
+  if (remaining < 0)
+    remaining = 0;
+  if (duration_ms >= MAX_COUNTDOWN_MS - remaining) {
+    ESP_LOGW(TAG, "extending countdown %d by %" PRIu32 " ms makes it too long", slot, duration_ms);
+    return false;
+  }
+  countdown.deadline += duration_ms;
+  return true;
+}
+
+void Timer::check_countdowns_(uint32_t now) {
+  if (this->active_countdowns_ == 0)
+    return;
+  for (auto &countdown : this->countdowns_) {
+    // signed difference keeps this right across the millis() rollover
+    if (!countdown.active || (int32_t) (now - countdown.deadline) < 0)
+      continue;
+    countdown.active = false;
+    this->active_countdowns_--;
+    ESP_LOGD(TAG, "countdown done, output %d with action %f", countdown.output, countdown.action);
+    this->output_(countdown.output, countdown.action);
+  }
+}
+
+void Timer::start_ramp_(uint8_t output, float from, float to, uint16_t duration, time_t now) {
+  // a new ramp on an output replaces the one already running there
+  Ramp *slot = nullptr;
+  for (auto &ramp : this->ramps_) {
+    if (ramp.active && (ramp.output == output)) {
+      slot = &ramp;
+      break;
+    }
+    if (!ramp.active && (slot == nullptr))
+      slot = &ramp;
+  }
+  if (slot == nullptr) {
+    ESP_LOGW(TAG, "no free ramp slot, setting output %d to %f", output, to);
+    this->write_output_(output, to);
+    return;
+  }
+  uint16_t index = slot - this->ramps_.data();
+  if (slot->active)
+    this->scheduler_->schedule(this, index, slot->next_step, 0, DEADLINE_RAMP);
+  slot->active = true;
+  slot->output = output;
+  slot->from = from;
+  slot->to = to;
+  slot->start = now;
+  slot->duration = duration;
+  this->step_ramp_(index, now);
+}
+
+void Timer::step_ramp_(uint16_t index, time_t now) {
+  Ramp &ramp = this->ramps_[index];
+  time_t elapsed = now - ramp.start;
+  if (elapsed >= ramp.duration) {
+    ramp.active = false;
+    this->write_output_(ramp.output, ramp.to);
+    return;
+  }
+  this->write_output_(ramp.output, ramp.from + (ramp.to - ramp.from) * elapsed / ramp.duration);
+  ramp.next_step = std::min<time_t>(now + this->ramp_interval_, ramp.start + ramp.duration);
+  this->scheduler_->schedule(this, index, 0, ramp.next_step, DEADLINE_RAMP);
+}
+
+bool Timer::check_condition_(int8_t condition) {
+  // only evaluated when a timer fires, so conditional timers cost nothing in between
+  if (condition < 0)
+    return true;
+  if (size_t(condition) >= this->conditions_.size()) {
+    ESP_LOGE(TAG, "condition %d does not exist", condition);
+    return false;
+  }
+  return this->conditions_[condition]->check();
+}
+
+void Timer::output_(uint8_t output, float value) {
+  // a jump wins over a ramp still running on the same output
+  for (uint16_t index = 0; index < this->ramps_.size(); index++) {
+    Ramp &ramp = this->ramps_[index];
+    if (!ramp.active || (ramp.output != output))
+      continue;
+    ramp.active = false;
+    this->scheduler_->schedule(this, index, ramp.next_step, 0, DEADLINE_RAMP);
+  }
+  this->write_output_(output, value);
+}
+
+void Timer::write_output_(uint8_t output, float value) {
   if (output < this->outputs_.size())
-    this->outputs_[output](timer.action);
+    this->outputs_[output](value);
   else
     ESP_LOGE(TAG, "output %d does not exist", output);
-  time_t &next = std::get<1>(data);
-  next = std::get<0>(data).calc_next(this->time_, next);
-  std::get<2>(data).save(&timer);
+}
+
+void Timer::reschedule_(uint16_t slot, time_t next) {
+  time_t &current = std::get<1>(this->timers_[slot]);
+  this->scheduler_->schedule(this, slot, current, next);
+  current = next;
+  this->rescheduled_ = true;
+  this->scheduler_->mark_dirty();
+}
+
+bool Timer::flush_() {
+  bool changed = this->rescheduled_;
+  this->rescheduled_ = false;
+  for (uint16_t slot = 0; slot < this->timers_.size(); slot++) {
+    if (!this->dirty_[slot])
+      continue;
+    if (slot < this->num_persistent_) {
+      timer_tuple_t &data = this->timers_[slot];
+      // the ESP8266 hands out an unusable preference once its small pool is used up
+      if (!std::get<2>(data).save(&std::get<0>(data)) || !std::get<4>(data).save(&std::get<3>(data)))
+        ESP_LOGE(TAG, "could not save timer %d, preference storage may be full", slot + 1);
+    }
+    this->dirty_[slot] = false;
+    changed = true;
+  }
+  return changed;
+}
+
+std::vector<UpcomingEvent> Timer::next_events(size_t count, int output) const {
+  return this->scheduler_->next_events(count, this, output);
+}
+
+void Timer::add_next_events_sensor(text_sensor::TextSensor *sensor, uint8_t count, int output, bool all_blocks) {
+  this->next_events_sensors_.push_back(NextEventsSensor{sensor, count, output, all_blocks});
+}
+
+void Timer::publish_next_events_() {
+  for (auto &entry : this->next_events_sensors_) {
+    std::string state;
+    auto events = entry.all_blocks ? this->scheduler_->next_events(entry.count)
+                                   : this->next_events(entry.count, entry.output);
+    for (auto &event : events) {
+      if (!state.empty())
+        state += "; ";
+      state += ESPTime::from_epoch_local(event.when).strftime("%a %H:%M");
+      state += " " + event.owner->slot_name_(event.slot);
+      state += str_sprintf(" output %d=%g", event.output, event.action);
+    }
+    if (!entry.sensor->has_state() || (entry.sensor->state != state))
+      entry.sensor->publish_state(state);
+  }
+}
+
+std::string Timer::slot_name_(uint16_t slot) const {
+  if (slot >= this->num_persistent_)
+    return str_sprintf("Ephemeral%d", slot - this->num_persistent_ + 1);
+  if (slot < this->names_.size())
+    return this->names_[slot];
+  return str_sprintf("Timer%d", slot + 1);
 }
 
 void Timer::set_timer_text(text::Text *txt) {
@@ -258,8 +743,15 @@ void Timer::set_timer_text(text::Text *txt) {
 
 void Timer::set_timer_select(select::Select *sel) {
   this->select_ = sel;
-  sel->add_on_state_callback([this](std::string state, size_t index) {
-    this->choose_(index, false);
+  sel->add_on_state_callback([this, sel](std::string state, size_t index) {
+    this->choose_(index, sel);
+  });
+}
+
+void Timer::set_timer_number(number::Number *num) {
+  this->number_ = num;
+  num->add_on_state_callback([this, num](float state) {
+    this->choose_(int(state) - 1, num);
   });
 }
 
@@ -277,45 +769,53 @@ static void switch_output(switch_::Switch *sw, float action) {
 void Timer::add_switch_output(switch_::Switch *sw) {
   using namespace std::placeholders;
   this->outputs_.push_back(std::move(std::bind(switch_output, sw, _1)));
+  this->rampable_.push_back(false);
 }
 
 void Timer::add_automation_output(Trigger<float> *trigger) {
   using namespace std::placeholders;
   this->outputs_.push_back(std::move(std::bind(&Trigger<float>::trigger, trigger, _1)));
+  this->rampable_.push_back(true);
 }
 
 void Timer::choose(int index) {
-  this->choose_(index, true);
+  this->choose_(index, nullptr);
 }
 
 void Timer::set_timer_text(const std::string &value) {
   auto &data = this->timers_[this->selected_timer_];
-  std::get<0>(data).from_string(value);
+  std::get<0>(data).from_string(value, std::get<3>(data));
   this->updating_ = true;
   if (this->text_ != nullptr)
-    this->text_->make_call().set_value(std::get<0>(this->timers_[this->selected_timer_]).to_string()).perform();
+    this->text_->make_call().set_value(std::get<0>(data).to_string(std::get<3>(data))).perform();
   this->updating_ = false;
-  std::get<1>(data) = std::get<0>(data).calc_next(this->time_, 0);
-  std::get<2>(data).save(&std::get<0>(data));
+  this->dirty_[this->selected_timer_] = true;
+  this->reschedule_(this->selected_timer_, std::get<0>(data).calc_next(this->scheduler_->now(), 0));
 }
 
-void Timer::choose_(int index, bool update) {
+void Timer::choose_(int index, const EntityBase *source) {
   ESP_LOGD(TAG, "selecting timer %d", index);
-  if (index >= this->timers_.size())
+  if ((index < 0) || (index >= this->num_persistent_))
     return;
   if (index == this->selected_timer_)
     return;
   this->selected_timer_ = index;
   if (this->text_ != nullptr)
-    this->text_->make_call().set_value(std::get<0>(this->timers_[index]).to_string()).perform();
-  if (update && (this->select_ != nullptr))
+    this->text_->make_call().set_value(std::get<0>(this->timers_[index]).to_string(std::get<3>(this->timers_[index]))).perform();
+  if ((this->select_ != nullptr) && (this->select_ != source))
     this->select_->make_call().set_index(index).perform();
+  if ((this->number_ != nullptr) && (this->number_ != source))
+    this->number_->make_call().set_value(index + 1).perform();
 }
 
 void TimerSelect::control(const std::string &value) {
   this->publish_state(value);
 }
 
+void TimerNumber::control(float value) {
+  this->publish_state(value);
+}
+
 void TimerText::control(const std::string &value) {
   this->publish_state(value);
 }
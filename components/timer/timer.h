@@ -33,20 +33,57 @@ or connect to: http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html
 ****************************************************/
 
 #pragma once
+#include "time_estimate.h"
 #include "esphome/core/automation.h"
 #include "esphome/core/component.h"
+#include "esphome/components/number/number.h"
 #include "esphome/components/select/select.h"
 #include "esphome/components/switch/switch.h"
 #include "esphome/components/text/text.h"
+#include "esphome/components/text_sensor/text_sensor.h"
 #include "esphome/components/time/real_time_clock.h"
 
+#include <set>
 #include <string>
+#include <tuple>
 #include <vector>
 
 
 namespace esphome {
 namespace timer {
 
+// Build time default for a timer slot, emitted by __init__.py as a PROGMEM table.
+// Field order must match timer_settings() in __init__.py.
+struct TimerDefault {
+    bool live;
+    bool repeat;
+    bool use_negative_offset;
+    uint8_t days;
+    uint8_t mode;
+    uint8_t output;
+    float action;
+    float ramp_from;
+    uint16_t ramp_duration;
+    int8_t condition;
+    uint8_t hour;
+    uint8_t minute;
+};
+
+// A ramp from `from` to the timer's action over `duration` seconds.
+struct TimerRamp {
+    float from;
+    uint16_t duration;
+} __attribute__((packed));
+
+// Settings added after the saved layout of TimerData was fixed. They are saved together under
+// a second preference per slot, so timers saved by older builds still load and get the defaults here.
+struct TimerExtras {
+    TimerRamp ramp{0, 0};
+    int8_t condition{-1};
+
+    void reset();
+} __attribute__((packed));
+
 struct TimerData {
     bool valid : 1;
     bool live : 1;
@@ -72,44 +109,196 @@ struct TimerData {
     time_t last_ran_timestamp;
 
     TimerData();
-    std::string to_string() const;
+    std::string to_string(const TimerExtras &extras) const;
     void reset();
-    void from_string(const std::string& settings);
-    time_t calc_next(time::RealTimeClock *time, time_t last);
+    void from_string(const std::string& settings, TimerExtras &extras);
+    void from_default(const TimerDefault &settings, TimerExtras &extras);
+    time_t calc_next(time_t now, time_t last);
 } __attribute__((packed));
 
-using timer_tuple_t = std::tuple<TimerData, time_t, ESPPreferenceObject>;
+using timer_tuple_t = std::tuple<TimerData, time_t, ESPPreferenceObject, TimerExtras, ESPPreferenceObject>;
 
-class Timer : public Component {
+class Timer;
+
+enum DeadlineKind : uint8_t {
+  DEADLINE_TIMER,
+  DEADLINE_RAMP,
+};
+
+// slot is the timer slot of owner, or its ramp slot for DEADLINE_RAMP
+struct Deadline {
+  time_t when;
+  Timer *owner;
+  uint16_t slot;
+  DeadlineKind kind;
+
+  bool operator<(const Deadline &other) const {
+    return std::tie(when, owner, slot, kind) < std::tie(other.when, other.owner, other.slot, other.kind);
+  }
+};
+
+// An output moving from one value to another, stepped through the scheduler.
+struct Ramp {
+  bool active{false};
+  uint8_t output;
+  uint16_t duration;
+  float from;
+  float to;
+  time_t start;
+  time_t next_step;
+};
+
+struct UpcomingEvent {
+  time_t when;
+  Timer *owner;
+  uint16_t slot;
+  uint8_t output;
+  float action;
+};
+
+// Relative timer on millis(), for "turn off in 45 minutes".
+struct Countdown {
+  uint32_t deadline;
+  float action;
+  uint8_t output;
+  bool active{false};
+};
+
+// One per node. Every timer block registers here, so there is a single clock read,
+// a single ordered deadline set and a single persistence flush per tick.
+class TimerScheduler : public Component {
  public:
   float get_setup_priority() const override { return setup_priority::DATA; }
   void setup() override;
   void loop() override;
-  void dump_config() override;
 
+  // validation makes every block name the same clock
   void set_time(time::RealTimeClock *time) { time_ = time; }
-  void set_num_timers(int count);
+  void set_restore_time_estimate(bool restore) { restore_time_estimate_ = restore; }
+  void set_time_estimate_max_age(uint32_t max_age) { time_estimate_max_age_ = max_age; }
+  void register_timer(Timer *timer) { timers_.push_back(timer); }
+  void schedule(Timer *owner, uint16_t slot, time_t old_next, time_t next, DeadlineKind kind = DEADLINE_TIMER);
+  void mark_dirty() { dirty_ = true; }
+  time_t now();
+  // next firings across every block, or only those of owner and/or output
+  std::vector<UpcomingEvent> next_events(size_t count, const Timer *owner = nullptr, int output = -1) const;
+
+ protected:
+  time::RealTimeClock *time_{nullptr};
+  std::vector<Timer *> timers_;
+  std::set<Deadline> deadlines_;
+  bool init_done_{false};
+  bool dirty_{false};
+  uint32_t last_check_{0};
+  // The estimate only lives in RTC memory and is only trusted after a software, watchdog or
+  // brownout reset. It lags real time by up to one save interval plus the boot time per
+  // reset, and is dropped once it has gone time_estimate_max_age_ without real time.
+  bool restore_time_estimate_{false};
+  uint32_t time_estimate_max_age_{3600};
+  bool provisional_{false};
+  ESPPreferenceObject estimate_pref_;
+  TimeEstimate restored_{};
+  uint32_t estimate_millis_{0};
+  time_t last_estimate_save_{0};
+  bool estimate_save_failed_{false};
+
+  bool load_estimate_(TimeEstimate *estimate);
+  void store_estimate_(const TimeEstimate &estimate);
+  void save_estimate_(time_t now);
+  void flush_();
+};
+
+class Timer : public Component {
+  friend class TimerScheduler;
+
+ public:
+  float get_setup_priority() const override { return setup_priority::DATA; }
+  void setup() override;
+  void dump_config() override;
+
+  void set_scheduler(TimerScheduler *scheduler);
+  void set_num_timers(int count, uint32_t preference_base);
+  void set_num_ephemeral_timers(int count);
+  void set_num_countdowns(int count);
+  void set_max_catch_up(uint32_t max_catch_up) { max_catch_up_ = max_catch_up; }
+  void set_max_ramps(int count) { ramps_.resize(count); }
+  void set_ramp_interval(uint32_t interval) { ramp_interval_ = interval; }
+  void set_defaults(const TimerDefault *defaults, size_t count) {
+    defaults_ = defaults;
+    num_defaults_ = count;
+  }
   void add_switch_output(switch_::Switch *sw);
   void add_automation_output(Trigger<float> *trigger);
   void set_timer_text(text::Text *txt);
   void set_timer_select(select::Select *sel);
+  void set_timer_number(number::Number *num);
+  void add_next_events_sensor(text_sensor::TextSensor *sensor, uint8_t count, int output, bool all_blocks);
+  void set_names(const std::vector<std::string> &names) { names_ = names; }
+  void add_condition(Condition<> *condition) { conditions_.push_back(condition); }
 
   void choose(int index);
   void set_timer_text(const std::string &value);
+  std::vector<UpcomingEvent> next_events(size_t count, int output = -1) const;
+  // the shared scheduler, its next_events() covers every block on the node
+  TimerScheduler *get_scheduler() const { return scheduler_; }
+  // RAM only timers, never saved and not shown in the select. Returns the slot or -1 when full.
+  // Without Repeat;1 the slot is freed after the timer fires, otherwise remove it when done.
+  int add_ephemeral_timer(const std::string &settings);
+  bool remove_ephemeral_timer(int slot);
+  // Returns the countdown slot, or -1 when full or duration_ms is not below INT32_MAX.
+  // Works before the clock is synced.
+  int start_countdown(uint8_t output, float action, uint32_t duration_ms);
+  bool cancel_countdown(int slot);
+  bool extend_countdown(int slot, uint32_t duration_ms);
 
  protected:
-  time::RealTimeClock *time_;
+  struct NextEventsSensor {
+    text_sensor::TextSensor *sensor;
+    uint8_t count;
+    int output;
+    bool all_blocks;
+  };
+
+  TimerScheduler *scheduler_{nullptr};
   std::vector<timer_tuple_t> timers_;
+  uint16_t num_persistent_{0};
+  uint32_t max_catch_up_{600};
+  const TimerDefault *defaults_{nullptr};
+  size_t num_defaults_{0};
+  // slots whose settings were edited and need saving; reschedules only set rescheduled_,
+  // so a slot never edited is not saved and keeps following its build time default
+  std::vector<bool> dirty_;
+  bool rescheduled_{false};
+  std::vector<Countdown> countdowns_;
+  std::vector<Ramp> ramps_;
+  uint32_t ramp_interval_{1};
+  uint8_t active_countdowns_{0};
   std::vector<std::function<void(float)>> outputs_;
+  // false for switch outputs, which only understand the 0, 1 and 2 actions
+  std::vector<bool> rampable_;
+  std::vector<Condition<> *> conditions_;
   text::Text *text_{nullptr};
   select::Select *select_{nullptr};
+  number::Number *number_{nullptr};
+  std::vector<NextEventsSensor> next_events_sensors_;
+  std::vector<std::string> names_;
   int selected_timer_{-1};
   bool updating_{false};
-  bool init_done_{false};
-  uint32_t last_check_{0};
 
-  void choose_(int index, bool update);
-  void trigger_timer_(timer_tuple_t &data);
+  // source is the entity the choice came from, every other picker is synced to it
+  void choose_(int index, const EntityBase *source);
+  void start_(time_t now);
+  void fire_(uint16_t slot, time_t now);
+  void check_countdowns_(uint32_t now);
+  void start_ramp_(uint8_t output, float from, float to, uint16_t duration, time_t now);
+  void step_ramp_(uint16_t index, time_t now);
+  bool check_condition_(int8_t condition);
+  void output_(uint8_t output, float value);
+  void write_output_(uint8_t output, float value);
+  void reschedule_(uint16_t slot, time_t next);
+  bool flush_();
+  void publish_next_events_();
+  std::string slot_name_(uint16_t slot) const;
 };
 
 class TimerText : public Component, public text::Text {
@@ -122,5 +311,10 @@ class TimerSelect : public Component, public select::Select {
   void control(const std::string &value);
 };
 
+class TimerNumber : public Component, public number::Number {
+ public:
+  void control(float value);
+};
+
 }  // namespace timer
 }  // namespace esphome
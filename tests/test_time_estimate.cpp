@@ -0,0 +1,65 @@
+// Host test for the time estimate helpers, no ESPHome needed:
+//   g++ -std=c++17 -Wall -Wextra -I components/timer tests/test_time_estimate.cpp -o test_time_estimate && ./test_time_estimate
+
+#include "time_estimate.h"
+
+#include <cstdio>
+
+using esphome::timer::TimeEstimate;
+using esphome::timer::TIME_ESTIMATE_MAGIC;
+using esphome::timer::estimate_epoch;
+using esphome::timer::should_catch_up;
+
+static int failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+static const time_t EPOCH = 1700000000;
+
+static void test_magic() {
+  CHECK(estimate_epoch(TimeEstimate{TIME_ESTIMATE_MAGIC, EPOCH, 0}, 5, 3600) == EPOCH + 5);
+  // a power loss leaves garbage, an expired estimate has its magic cleared
+  CHECK(estimate_epoch(TimeEstimate{0, EPOCH, 0}, 5, 3600) == 0);
+  CHECK(estimate_epoch(TimeEstimate{TIME_ESTIMATE_MAGIC ^ 1, EPOCH, 0}, 5, 3600) == 0);
+  CHECK(estimate_epoch(TimeEstimate{TIME_ESTIMATE_MAGIC, 0, 0}, 5, 3600) == 0);
+}
+
+static void test_max_age() {
+  CHECK(estimate_epoch(TimeEstimate{TIME_ESTIMATE_MAGIC, EPOCH, 3000}, 600, 3600) == EPOCH + 600);
+  CHECK(estimate_epoch(TimeEstimate{TIME_ESTIMATE_MAGIC, EPOCH, 3000}, 601, 3600) == 0);
+  CHECK(estimate_epoch(TimeEstimate{TIME_ESTIMATE_MAGIC, EPOCH, 3600}, 0, 3600) == EPOCH);
+  CHECK(estimate_epoch(TimeEstimate{TIME_ESTIMATE_MAGIC, EPOCH, 3601}, 0, 3600) == 0);
+  // unsynced + elapsed would wrap a uint32_t back under max_age
+  CHECK(estimate_epoch(TimeEstimate{TIME_ESTIMATE_MAGIC, EPOCH, UINT32_MAX}, 2, 3600) == 0);
+  CHECK(estimate_epoch(TimeEstimate{TIME_ESTIMATE_MAGIC, EPOCH, 100}, UINT32_MAX - 50, 3600) == 0);
+  CHECK(estimate_epoch(TimeEstimate{TIME_ESTIMATE_MAGIC, EPOCH, 0}, UINT32_MAX, UINT32_MAX) == EPOCH + UINT32_MAX);
+}
+
+static void test_catch_up() {
+  CHECK(should_catch_up(EPOCH - 600, EPOCH, 600));
+  CHECK(!should_catch_up(EPOCH - 601, EPOCH, 600));
+  CHECK(should_catch_up(EPOCH - 1, EPOCH, 600));
+  // not missed yet, or never scheduled
+  CHECK(!should_catch_up(EPOCH, EPOCH, 600));
+  CHECK(!should_catch_up(EPOCH + 1, EPOCH, 600));
+  CHECK(!should_catch_up(0, EPOCH, 600));
+  CHECK(!should_catch_up(EPOCH - 1, EPOCH, 0));
+}
+
+int main() {
+  test_magic();
+  test_max_age();
+  test_catch_up();
+  if (failures) {
+    std::printf("%d checks failed\n", failures);
+    return 1;
+  }
+  std::printf("all checks passed\n");
+  return 0;
+}